@@ -0,0 +1,667 @@
+/*
+ ============================================================================
+ Name        : bench.c
+ Author      : Anthony Black
+ Description : CS430 Project 4: Ray Tracing, benchmarks
+ ============================================================================
+ */
+
+#include "raytrace.h"
+#include <time.h>
+
+//what write_random_scene() puts in a generated scene
+typedef struct SceneSpec{
+  int spheres;
+  int planes;
+  int lights;
+  double reflective; //fraction of objects that reflect
+  double refractive; //fraction of spheres that refract
+  unsigned int seed;
+} SceneSpec;
+
+//PROTOTYPE DECLARATIONS
+
+double now_seconds();
+
+double random_range(unsigned int *seed, double low, double high);
+
+int bench_intersect(int argc, char *argv[]);
+
+int bench_parse(int argc, char *argv[]);
+
+int bench_generate(int argc, char *argv[]);
+
+int bench_render(int argc, char *argv[]);
+
+int bench_micro(int argc, char *argv[]);
+
+void default_spec(SceneSpec *spec);
+
+int parse_spec_option(SceneSpec *spec, int argc, char *argv[], int *i);
+
+void write_random_scene(FILE *file, SceneSpec *spec);
+
+long make_scene_file(SceneSpec *spec, char *filename);
+
+void usage(char *program);
+
+//===========================================================================================================
+
+//FUNCTIONS
+
+int main(int argc, char *argv[]) {
+	/*
+	inputs:
+		int argc: the number of arguments in argv[]
+		char *argv[]: the benchmark to run followed by its arguments:
+		  intersect [primitives] [rays]
+		  parse [objects]
+		  generate out.json [scene options]
+		  render [scene options] [--width N] [--height N] [--threads N] [--wavefront]
+		  micro [scene options]
+		  where the scene options are --spheres N --planes N --lights N
+		  --reflective F --refractive F --seed N
+	output:
+		int: EXIT_SUCCESS if the benchmark ran
+	function:
+		runs one of the benchmarks and prints its results to stdout as JSON.
+	*/
+  if (argc < 2){
+    usage(argv[0]);
+    return 1;
+  }
+  if (strcmp(argv[1], "intersect") == 0){
+    return bench_intersect(argc-2, argv+2);
+  }
+  if (strcmp(argv[1], "parse") == 0){
+    return bench_parse(argc-2, argv+2);
+  }
+  if (strcmp(argv[1], "generate") == 0){
+    return bench_generate(argc-2, argv+2);
+  }
+  if (strcmp(argv[1], "render") == 0){
+    return bench_render(argc-2, argv+2);
+  }
+  if (strcmp(argv[1], "micro") == 0){
+    return bench_micro(argc-2, argv+2);
+  }
+  usage(argv[0]);
+  return 1;
+}
+
+void usage(char *program){
+	/*
+	inputs:
+		char *program: the name the program was run as
+	output:
+		void
+	function:
+		usage() lists the benchmarks on stderr.
+	*/
+  fprintf(stderr, "Usage: %s intersect [primitives] [rays]\n", program);
+  fprintf(stderr, "       %s parse [objects]\n", program);
+  fprintf(stderr, "       %s generate out.json [scene options]\n", program);
+  fprintf(stderr, "       %s render [scene options] [--width N] [--height N] [--threads N] [--wavefront]\n", program);
+  fprintf(stderr, "       %s micro [scene options]\n", program);
+  fprintf(stderr, "scene options: --spheres N --planes N --lights N --reflective F --refractive F --seed N\n");
+}
+
+double now_seconds(){
+	/*
+	output:
+		double: seconds on a monotonic clock
+	function:
+		now_seconds() reads the clock used to time the benchmarks.
+	*/
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+double random_range(unsigned int *seed, double low, double high){
+	/*
+	inputs:
+		unsigned int *seed: state of the random number generator, updated
+		double low: smallest value returned
+		double high: largest value returned
+	output:
+		double: a random number between low and high
+	function:
+		random_range() gives repeatable random numbers so every run measures the same work.
+	*/
+  return low + (high - low) * ((double)rand_r(seed) / RAND_MAX);
+}
+
+int bench_intersect(int argc, char *argv[]){
+	/*
+	inputs:
+		int argc: number of arguments
+		char *argv[]: optional number of primitives (default 4096) and rays (default 2000)
+	output:
+		int: EXIT_SUCCESS, or 1 if two kernels disagree
+	function:
+		bench_intersect() times every intersection kernel the CPU supports, testing
+		each ray against every sphere and then every plane in KERNEL_BATCH runs, the
+		way shoot() hands leaves to the kernels. It reports intersection tests per
+		second, and checks all kernels return exactly the same distances.
+	*/
+  int num_primitives = argc > 0 ? atoi(argv[0]) : 4096;
+  int num_rays = argc > 1 ? atoi(argv[1]) : 2000;
+  if (num_primitives <= 0 || num_rays <= 0){
+    fprintf(stderr, "Error: Primitive and ray counts must be positive.\n");
+    return 1;
+  }
+  unsigned int seed = 430;
+  Scene scene;
+  scene.num_objects = 2*num_primitives;
+  scene.objects = calloc(scene.num_objects, sizeof(Object));
+  int *sphere_indices = malloc(num_primitives*sizeof(int));
+  int *plane_indices = malloc(num_primitives*sizeof(int));
+  for (int i = 0; i < num_primitives; i += 1){
+    Object *sphere = &scene.objects[i];
+    sphere->type = 0;
+    sphere->position[0] = random_range(&seed, -10, 10);
+    sphere->position[1] = random_range(&seed, -10, 10);
+    sphere->position[2] = random_range(&seed, 5, 25);
+    sphere->sphere.radius = random_range(&seed, 0.1, 2);
+    sphere_indices[i] = i;
+    Object *plane = &scene.objects[num_primitives+i];
+    plane->type = 1;
+    for (int k = 0; k < 3; k += 1){
+      plane->position[k] = random_range(&seed, -10, 10);
+      plane->plane.normal[k] = random_range(&seed, -1, 1);
+    }
+    vector_normalize(plane->plane.normal);
+    plane_indices[i] = num_primitives+i;
+  }
+  build_arrays(&scene, sphere_indices, num_primitives, plane_indices, num_primitives);
+  double *rays = malloc(num_rays*6*sizeof(double));
+  for (int i = 0; i < num_rays; i += 1){
+    for (int k = 0; k < 3; k += 1){
+      rays[i*6+k] = random_range(&seed, -1, 1);
+      rays[i*6+3+k] = random_range(&seed, -1, 1);
+    }
+    rays[i*6+5] = fabs(rays[i*6+5]) + 0.5; //mostly towards the spheres
+    vector_normalize(&rays[i*6+3]);
+  }
+
+  const char *names[3] = {"scalar", "sse2", "avx2"};
+  double t[KERNEL_BATCH + KERNEL_PAD];
+  double reference[2] = {0, 0};
+  int mismatch = 0;
+  int printed = 0;
+  double tests = (double)num_primitives * num_rays;
+  printf("{\n  \"benchmark\": \"intersect\",\n  \"primitives\": %d,\n  \"rays\": %d,\n  \"kernels\": [", num_primitives, num_rays);
+  for (int n = 0; n < 3; n += 1){
+    if (!kernels_supported(names[n])){
+      continue;
+    }
+    select_kernels(names[n]);
+    double checksum[2] = {0, 0};
+    double start = now_seconds();
+    for (int i = 0; i < num_rays; i += 1){
+      for (int first = 0; first < num_primitives; first += KERNEL_BATCH){
+        int count = num_primitives - first < KERNEL_BATCH ? num_primitives - first : KERNEL_BATCH;
+        kernels.spheres(&scene.spheres, first, count, &rays[i*6], &rays[i*6+3], t);
+        for (int k = 0; k < count; k += 1){
+          checksum[0] += t[k];
+        }
+      }
+    }
+    double sphere_time = now_seconds() - start;
+    start = now_seconds();
+    for (int i = 0; i < num_rays; i += 1){
+      for (int first = 0; first < num_primitives; first += KERNEL_BATCH){
+        int count = num_primitives - first < KERNEL_BATCH ? num_primitives - first : KERNEL_BATCH;
+        kernels.planes(&scene.planes, first, count, &rays[i*6], &rays[i*6+3], t);
+        for (int k = 0; k < count; k += 1){
+          checksum[1] += t[k];
+        }
+      }
+    }
+    double plane_time = now_seconds() - start;
+    if (printed == 0){
+      reference[0] = checksum[0];
+      reference[1] = checksum[1];
+    }
+    else if (checksum[0] != reference[0] || checksum[1] != reference[1]){
+      mismatch = 1;
+    }
+    printf("%s\n    {\"kernel\": \"%s\", \"sphere_tests_per_second\": %.0f, \"plane_tests_per_second\": %.0f, \"checksum\": [%.17g, %.17g]}",
+        printed ? "," : "", names[n], tests / sphere_time, tests / plane_time, checksum[0], checksum[1]);
+    printed += 1;
+  }
+  printf("\n  ],\n  \"identical\": %s\n}\n", mismatch ? "false" : "true");
+
+  free(rays);
+  free_arrays(&scene);
+  free(sphere_indices);
+  free(plane_indices);
+  free(scene.objects);
+  if (mismatch){
+    fprintf(stderr, "Error: Intersection kernels disagree.\n");
+    return 1;
+  }
+  return EXIT_SUCCESS;
+}
+
+void default_spec(SceneSpec *spec){
+	/*
+	inputs:
+		SceneSpec *spec: the spec to fill in
+	output:
+		void
+	function:
+		default_spec() sets up a medium sized scene: 1000 spheres in a box of 5
+		planes, 4 lights, a fifth of the spheres reflective and a tenth refractive.
+	*/
+  spec->spheres = 1000;
+  spec->planes = 5;
+  spec->lights = 4;
+  spec->reflective = 0.2;
+  spec->refractive = 0.1;
+  spec->seed = 430;
+}
+
+int parse_spec_option(SceneSpec *spec, int argc, char *argv[], int *i){
+	/*
+	inputs:
+		SceneSpec *spec: the spec to change
+		int argc: number of arguments
+		char *argv[]: the arguments
+		int *i: index of the option to read, moved past its value
+	output:
+		int: 1 if argv[*i] was a scene option, 0 if not
+	function:
+		parse_spec_option() reads one of --spheres N, --planes N, --lights N,
+		--reflective F, --refractive F or --seed N, exiting on a missing or bad value.
+	*/
+  const char *names[6] = {"--spheres", "--planes", "--lights", "--reflective", "--refractive", "--seed"};
+  int option = -1;
+  for (int k = 0; k < 6; k += 1){
+    if (strcmp(argv[*i], names[k]) == 0){
+      option = k;
+    }
+  }
+  if (option < 0){
+    return 0;
+  }
+  if (*i+1 >= argc){
+    fprintf(stderr, "Error: %s requires a value.\n", names[option]);
+    exit(1);
+  }
+  *i += 1;
+  double value = atof(argv[*i]);
+  if (value < 0 || (option >= 3 && option <= 4 && value > 1)){
+    fprintf(stderr, "Error: Bad value for %s.\n", names[option]);
+    exit(1);
+  }
+  switch (option){
+    case 0: spec->spheres = (int)value; break;
+    case 1: spec->planes = (int)value; break;
+    case 2: spec->lights = (int)value; break;
+    case 3: spec->reflective = value; break;
+    case 4: spec->refractive = value; break;
+    default: spec->seed = (unsigned int)value; break;
+  }
+  return 1;
+}
+
+void write_random_scene(FILE *file, SceneSpec *spec){
+	/*
+	inputs:
+		FILE *file: where to write the scene
+		SceneSpec *spec: how many of each thing to put in the scene
+	output:
+		void
+	function:
+		write_random_scene() writes a JSON scene in the same layout as example.json.
+		Spheres are scattered through the view of a 90 degree camera. Planes close
+		the scene in: first a floor and a back wall, then the side walls and the
+		ceiling, then more back walls further away. Lights sit above the spheres,
+		and every second one is a spotlight. Each sphere is reflective with
+		probability spec->reflective and refractive with probability spec->refractive.
+		The same spec always gives the same file.
+	*/
+  unsigned int seed = spec->seed;
+  //position and normal of the planes, in the order they are added
+  const double walls[5][6] = {
+    {0, -25, 0, 0, 1, 0}, {0, 0, 60, 0, 0, -1}, {-50, 0, 0, 1, 0, 0}, {50, 0, 0, -1, 0, 0}, {0, 50, 0, 0, -1, 0}};
+  fprintf(file, "[\n\t{\n\t\t\"type\": \"camera\",\n\t\t\"width\": 2.0,\n\t\t\"height\": 2.0\n\t}");
+  for (int i = 0; i < spec->lights; i += 1){
+    fprintf(file, ",\n\t{\n\t\t\"type\": \"light\",\n\t\t\"color\": [%.6f, %.6f, %.6f],\n", 
+        random_range(&seed, 0.5, 1.5), random_range(&seed, 0.5, 1.5), random_range(&seed, 0.5, 1.5));
+    if (i % 2 == 1){
+      fprintf(file, "\t\t\"theta\": %.6f,\n\t\t\"direction\": [%.6f, -1, %.6f],\n\t\t\"angular-a0\": 1.0,\n",
+          random_range(&seed, 20, 60), random_range(&seed, -0.5, 0.5), random_range(&seed, 0, 1));
+    }
+    else{
+      fprintf(file, "\t\t\"theta\": 0,\n");
+    }
+    fprintf(file, "\t\t\"radial-a2\": 0.0005,\n\t\t\"radial-a1\": 0.005,\n\t\t\"radial-a0\": 0.5,\n"
+        "\t\t\"position\": [%.6f, %.6f, %.6f]\n\t}",
+        random_range(&seed, -20, 20), random_range(&seed, 25, 40), random_range(&seed, 0, 30));
+  }
+  for (int i = 0; i < spec->planes; i += 1){
+    double position[3] = {walls[i < 5 ? i : 1][0], walls[i < 5 ? i : 1][1], walls[i < 5 ? i : 1][2]};
+    const double *normal = &walls[i < 5 ? i : 1][3];
+    if (i >= 5){
+      position[2] += 5*(i-4);
+    }
+    fprintf(file, ",\n\t{\n\t\t\"type\": \"plane\",\n\t\t\"reflectivity\": %.6f,\n"
+        "\t\t\"diffuse_color\": [%.6f, %.6f, %.6f],\n\t\t\"specular_color\": [0.2, 0.2, 0.2],\n"
+        "\t\t\"position\": [%.6f, %.6f, %.6f],\n\t\t\"normal\": [%.0f, %.0f, %.0f]\n\t}",
+        random_range(&seed, 0, 1) < spec->reflective ? random_range(&seed, 0.2, 0.5) : 0,
+        random_range(&seed, 0.2, 1), random_range(&seed, 0.2, 1), random_range(&seed, 0.2, 1),
+        position[0], position[1], position[2], normal[0], normal[1], normal[2]);
+  }
+  for (int i = 0; i < spec->spheres; i += 1){
+    double reflectivity = random_range(&seed, 0, 1) < spec->reflective ? random_range(&seed, 0.2, 0.45) : 0;
+    double refractivity = random_range(&seed, 0, 1) < spec->refractive ? random_range(&seed, 0.2, 0.45) : 0;
+    fprintf(file, ",\n\t{\n\t\t\"type\": \"sphere\",\n\t\t\"radius\": %.6f,\n"
+        "\t\t\"reflectivity\": %.6f,\n\t\t\"refractivity\": %.6f,\n\t\t\"ior\": %.6f,\n"
+        "\t\t\"diffuse_color\": [%.6f, %.6f, %.6f],\n\t\t\"specular_color\": [%.6f, %.6f, %.6f],\n"
+        "\t\t\"position\": [%.6f, %.6f, %.6f]\n\t}",
+        random_range(&seed, 0.2, 2), reflectivity, refractivity, random_range(&seed, 1.1, 1.6),
+        random_range(&seed, 0, 1), random_range(&seed, 0, 1), random_range(&seed, 0, 1),
+        random_range(&seed, 0, 1), random_range(&seed, 0, 1), random_range(&seed, 0, 1),
+        random_range(&seed, -20, 20), random_range(&seed, -20, 20), random_range(&seed, 10, 50));
+  }
+  fprintf(file, "\n]\n");
+}
+
+long make_scene_file(SceneSpec *spec, char *filename){
+	/*
+	inputs:
+		SceneSpec *spec: the scene to generate
+		char *filename: a mkstemp() template, replaced by the name of the file made
+	output:
+		long: size of the file in bytes
+	function:
+		make_scene_file() writes a generated scene to a new temporary file. The
+		caller unlinks it.
+	*/
+  int descriptor = mkstemp(filename);
+  FILE *file = descriptor < 0 ? NULL : fdopen(descriptor, "w");
+  if (file == NULL){
+    fprintf(stderr, "Error: Unable to create temporary scene file.\n");
+    exit(1);
+  }
+  write_random_scene(file, spec);
+  long bytes = ftell(file);
+  fclose(file);
+  return bytes;
+}
+
+int bench_generate(int argc, char *argv[]){
+	/*
+	inputs:
+		int argc: number of arguments
+		char *argv[]: the file to write, then any scene options
+	output:
+		int: EXIT_SUCCESS, or 1 on a bad argument
+	function:
+		bench_generate() saves a generated scene so it can be rendered with ./raytrace.
+	*/
+  SceneSpec spec;
+  char *filename = NULL;
+  default_spec(&spec);
+  for (int i = 0; i < argc; i += 1){
+    if (!parse_spec_option(&spec, argc, argv, &i)){
+      filename = argv[i];
+    }
+  }
+  if (filename == NULL){
+    fprintf(stderr, "Error: generate requires an output file.\n");
+    return 1;
+  }
+  FILE *file = fopen(filename, "w");
+  if (file == NULL){
+    fprintf(stderr, "Error: Unable to open output file.\n");
+    return 1;
+  }
+  write_random_scene(file, &spec);
+  fclose(file);
+  return EXIT_SUCCESS;
+}
+
+int bench_parse(int argc, char *argv[]){
+	/*
+	inputs:
+		int argc: number of arguments
+		char *argv[]: optional number of spheres in the generated scene (default 1000000)
+	output:
+		int: EXIT_SUCCESS, or 1 on a bad argument
+	function:
+		bench_parse() writes a random scene to a temporary file and times read_scene()
+		on it, reporting the best of three loads in MB/s and objects per second.
+	*/
+  SceneSpec spec;
+  default_spec(&spec);
+  spec.spheres = argc > 0 ? atoi(argv[0]) : 1000000;
+  if (spec.spheres <= 0){
+    fprintf(stderr, "Error: Object count must be positive.\n");
+    return 1;
+  }
+  char filename[] = "/tmp/bench_sceneXXXXXX";
+  long bytes = make_scene_file(&spec, filename);
+
+  double best = INFINITY;
+  Scene scene;
+  for (int i = 0; i < 3; i += 1){
+    double start = now_seconds();
+    read_scene(filename, &scene);
+    double time = now_seconds() - start;
+    if (time < best){
+      best = time;
+    }
+    if (i < 2){
+      free_scene(&scene);
+    }
+  }
+  unlink(filename);
+  printf("{\n  \"benchmark\": \"parse\",\n  \"objects\": %d,\n  \"lights\": %d,\n  \"bytes\": %ld,\n"
+      "  \"seconds\": %.6f,\n  \"mb_per_second\": %.1f,\n  \"objects_per_second\": %.0f\n}\n",
+      scene.num_objects, scene.num_lights, bytes, best, bytes / best / 1e6, scene.num_objects / best);
+  free_scene(&scene);
+  return EXIT_SUCCESS;
+}
+
+int bench_render(int argc, char *argv[]){
+	/*
+	inputs:
+		int argc: number of arguments
+		char *argv[]: scene options, plus --width N, --height N (default 800), --threads N (default 1)
+		  and --wavefront to render with wavefront_tile()
+	output:
+		int: EXIT_SUCCESS, or 1 on a bad argument
+	function:
+		bench_render() runs the whole program on a generated scene and times each
+		stage: loading the JSON (with plane preparation and the BVH build), rendering,
+		and writing the image as P3 and as P6. It reports the number of primary,
+		secondary and shadow rays traced, and rays per second of render time.
+	*/
+  SceneSpec spec;
+  RenderOptions options;
+  int width = 800;
+  int height = 800;
+  default_spec(&spec);
+  default_options(&options);
+  for (int i = 0; i < argc; i += 1){
+    if (parse_spec_option(&spec, argc, argv, &i)){
+      continue;
+    }
+    if (i+1 < argc && strcmp(argv[i], "--width") == 0){
+      width = atoi(argv[++i]);
+    }
+    else if (i+1 < argc && strcmp(argv[i], "--height") == 0){
+      height = atoi(argv[++i]);
+    }
+    else if (i+1 < argc && strcmp(argv[i], "--threads") == 0){
+      options.threads = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--wavefront") == 0){
+      options.wavefront = 1;
+    }
+    else{
+      fprintf(stderr, "Error: Unknown render option \"%s\".\n", argv[i]);
+      return 1;
+    }
+  }
+  if (width <= 0 || height <= 0 || options.threads <= 0){
+    fprintf(stderr, "Error: Width, height and threads must be positive.\n");
+    return 1;
+  }
+  select_kernels(NULL);
+  char scene_file[] = "/tmp/bench_sceneXXXXXX";
+  make_scene_file(&spec, scene_file);
+  Scene scene;
+  double start = now_seconds();
+  load_scene(scene_file, &scene);
+  double load_time = now_seconds() - start;
+  unlink(scene_file);
+
+  Pixel *buffer = malloc((size_t)width*height*sizeof(Pixel));
+  start = now_seconds();
+  generate_scene(&scene, buffer, width, height, &options);
+  double render_time = now_seconds() - start;
+
+  char image_file[] = "/tmp/bench_imageXXXXXX";
+  int descriptor = mkstemp(image_file);
+  FILE *file = descriptor < 0 ? NULL : fdopen(descriptor, "w");
+  if (file == NULL){
+    fprintf(stderr, "Error: Unable to create temporary image file.\n");
+    return 1;
+  }
+  start = now_seconds();
+  write_p3(buffer, file, width, height, 255);
+  fclose(file);
+  double p3_time = now_seconds() - start;
+  start = now_seconds();
+  write_p6(buffer, image_file, width, height, 255, options.threads);
+  double p6_time = now_seconds() - start;
+  unlink(image_file);
+
+  Stats *stats = &options.stats;
+  long rays = stats->primary_rays + stats->reflection_rays + stats->refraction_rays + stats->shadow_rays;
+  printf("{\n  \"benchmark\": \"render\",\n  \"width\": %d,\n  \"height\": %d,\n  \"threads\": %d,\n  \"wavefront\": %s,\n  \"kernels\": \"%s\",\n"
+      "  \"scene\": {\"spheres\": %d, \"planes\": %d, \"lights\": %d, \"reflective\": %.3f, \"refractive\": %.3f, \"seed\": %u},\n"
+      "  \"seconds\": {\"load\": %.6f, \"render\": %.6f, \"write_p3\": %.6f, \"write_p6\": %.6f},\n"
+      "  \"rays\": {\"primary\": %ld, \"reflection\": %ld, \"refraction\": %ld, \"shadow\": %ld, \"total\": %ld},\n"
+      "  \"rays_per_second\": %.0f\n}\n",
+      width, height, options.threads, options.wavefront ? "true" : "false", kernels.name,
+      spec.spheres, spec.planes, spec.lights, spec.reflective, spec.refractive, spec.seed,
+      load_time, render_time, p3_time, p6_time,
+      stats->primary_rays, stats->reflection_rays, stats->refraction_rays, stats->shadow_rays, rays, rays / render_time);
+  free(buffer);
+  free_scene(&scene);
+  return EXIT_SUCCESS;
+}
+
+int bench_micro(int argc, char *argv[]){
+	/*
+	inputs:
+		int argc: number of arguments
+		char *argv[]: scene options for the scene shoot() and recursive_shade() run in
+	output:
+		int: EXIT_SUCCESS, or 1 on a bad argument
+	function:
+		bench_micro() times single calls of sphere_intersection(), plane_intersection(),
+		shoot() and recursive_shade() over the same set of camera rays through a
+		generated scene, and reports nanoseconds per call. A checksum of the results
+		is printed so the compiler cannot drop the work.
+	*/
+  SceneSpec spec;
+  default_spec(&spec);
+  for (int i = 0; i < argc; i += 1){
+    if (!parse_spec_option(&spec, argc, argv, &i)){
+      fprintf(stderr, "Error: Unknown micro option \"%s\".\n", argv[i]);
+      return 1;
+    }
+  }
+  select_kernels(NULL);
+  char scene_file[] = "/tmp/bench_sceneXXXXXX";
+  make_scene_file(&spec, scene_file);
+  Scene scene;
+  load_scene(scene_file, &scene);
+  unlink(scene_file);
+  if (scene.num_objects == 0){
+    fprintf(stderr, "Error: The scene needs at least one object.\n");
+    return 1;
+  }
+
+  int num_rays = 20000;
+  unsigned int seed = 430;
+  double Ro[3] = {0, 0, 0};
+  double (*rays)[3] = malloc(num_rays*sizeof(*rays));
+  for (int i = 0; i < num_rays; i += 1){
+    rays[i][0] = random_range(&seed, -1, 1);
+    rays[i][1] = random_range(&seed, -1, 1);
+    rays[i][2] = 1;
+    vector_normalize(rays[i]);
+  }
+  const char *names[4] = {"sphere_intersection", "plane_intersection", "shoot", "recursive_shade"};
+  double seconds[4];
+  long calls[4];
+  double checksum[4] = {0, 0, 0, 0};
+  Object *sphere = NULL;
+  Object *plane = NULL;
+  for (int i = 0; i < scene.num_objects; i += 1){
+    if (scene.objects[i].type == 0 && sphere == NULL) sphere = &scene.objects[i];
+    if (scene.objects[i].type == 1 && plane == NULL) plane = &scene.objects[i];
+  }
+
+  double start = now_seconds();
+  calls[0] = 0;
+  for (int repeat = 0; repeat < 100 && sphere != NULL; repeat += 1){
+    for (int i = 0; i < num_rays; i += 1){
+      checksum[0] += sphere_intersection(Ro, rays[i], sphere->position, sphere->sphere.radius);
+    }
+    calls[0] += num_rays;
+  }
+  seconds[0] = now_seconds() - start;
+  start = now_seconds();
+  calls[1] = 0;
+  for (int repeat = 0; repeat < 100 && plane != NULL; repeat += 1){
+    for (int i = 0; i < num_rays; i += 1){
+      checksum[1] += plane_intersection(Ro, rays[i], plane->position, plane->plane.normal);
+    }
+    calls[1] += num_rays;
+  }
+  seconds[1] = now_seconds() - start;
+  ThreadContext context;
+  context_init(&context, &scene, 0);
+  Closest *hits = malloc(num_rays*sizeof(Closest));
+  start = now_seconds();
+  for (int i = 0; i < num_rays; i += 1){
+    hits[i] = shoot(Ro, rays[i], &scene, &context);
+    checksum[2] += hits[i].closest_t < INFINITY ? hits[i].closest_t : 0;
+  }
+  calls[2] = num_rays;
+  seconds[2] = now_seconds() - start;
+  start = now_seconds();
+  calls[3] = 0;
+  for (int i = 0; i < num_rays; i += 1){
+    if (hits[i].closest_t > 0 && hits[i].closest_t < INFINITY){
+      Color color = recursive_shade(&scene, &context, Ro, rays[i], &hits[i], 0, 1.0, 1.0, 0);
+      checksum[3] += color.r + color.g + color.b;
+      calls[3] += 1;
+    }
+  }
+  seconds[3] = now_seconds() - start;
+  context_free(&context);
+
+  printf("{\n  \"benchmark\": \"micro\",\n  \"kernels\": \"%s\",\n"
+      "  \"scene\": {\"spheres\": %d, \"planes\": %d, \"lights\": %d, \"reflective\": %.3f, \"refractive\": %.3f, \"seed\": %u},\n"
+      "  \"functions\": [",
+      kernels.name, spec.spheres, spec.planes, spec.lights, spec.reflective, spec.refractive, spec.seed);
+  for (int k = 0; k < 4; k += 1){
+    printf("%s\n    {\"function\": \"%s\", \"calls\": %ld, \"ns_per_call\": %.2f, \"checksum\": %.17g}",
+        k ? "," : "", names[k], calls[k], calls[k] > 0 ? seconds[k] * 1e9 / calls[k] : 0, checksum[k]);
+  }
+  printf("\n  ]\n}\n");
+  free(hits);
+  free(rays);
+  free_scene(&scene);
+  return EXIT_SUCCESS;
+}
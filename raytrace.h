@@ -0,0 +1,960 @@
+/*
+ ============================================================================
+ Name        : raytrace.h
+ Author      : Anthony Black
+ Description : CS430 Project 4: Ray Tracing, structures and prototypes
+ ============================================================================
+ */
+
+#ifndef RAYTRACE_H
+#define RAYTRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+//#define DEBUG 1 //uncomment to see print statements
+//#define STATS 1 //uncomment, or build with "make STATS=1", to count rays and tests for --stats
+#define MAX_DEPTH 7 //default for --max-depth, the deepest surface reflections and refractions are followed from
+#define MIN_WEIGHT 0.001 //default for --min-weight, well under one step of an 8 bit color channel
+#define STATS_DEPTHS 16 //buckets of the depth histogram, the last one also counts everything deeper
+#define TILE_SIZE 32 //width and height in pixels of a render tile handed to a worker
+#define BVH_BINS 16 //number of centroid buckets tried per axis when choosing a BVH split
+#define BVH_LEAF_SIZE 4 //nodes with this many spheres or fewer always become leaves
+#define BVH_MAX_LEAF_SIZE 16 //nodes with more spheres than this are always split
+#define BVH_MAX_DEPTH 64 //deepest the tree is allowed to grow, also the traversal stack size
+#define KERNEL_BATCH 64 //most primitives an intersection kernel is handed at once
+#define KERNEL_PAD 4 //SoA arrays have this many spare entries so kernels can read a whole vector past the end
+#define PACKET_SIZE 8 //primary rays are traced in PACKET_SIZE x PACKET_SIZE blocks
+#define PACKET_RAYS (PACKET_SIZE*PACKET_SIZE)
+#define PACKET_MIN_ACTIVE 16 //fewer rays than this reaching a leaf are tested one at a time
+#define SCENE_MAGIC "RTSCENE" //first bytes of a compiled scene, with the terminating 0
+#define SCENE_VERSION 3 //bump whenever the compiled scene layout or any struct in it changes
+#define GBUFFER_MAGIC "RTGBUF" //first bytes of a G-buffer file, with the terminating 0
+#define GBUFFER_VERSION 1 //bump whenever GBufferHeader or GBufferHit changes
+#define GBUFFER_LIGHTS 64 //lights whose shadows at the primary hits a G-buffer keeps
+#define INCREMENTAL_MAGIC "RTINCR" //first bytes of an incremental render's state file, with the terminating 0
+#define INCREMENTAL_VERSION 1 //bump whenever IncrementalHeader, ObjectRecord or the grid changes
+#define DEPS_GRID 32 //cells along each axis of the grid incremental renders track rays through
+#define DEPS_WORDS (DEPS_GRID*DEPS_GRID*DEPS_GRID/64 + 1) //per tile, a bit per cell and one for rays leaving the grid
+#define DEPS_OUTSIDE (DEPS_GRID*DEPS_GRID*DEPS_GRID) //the bit set for rays leaving the grid
+#define PARTIAL_MAGIC "RTPART" //first bytes of a partial image, with the terminating 0
+#define PARTIAL_VERSION 1 //bump whenever PartialHeader or the pixels after it change
+#define SCENE_CACHE 16 //scenes a render server keeps loaded
+#define SERVER_ARGS 256 //most strings in a render request, the directory included
+#define SERVER_ARG_SIZE 65536 //longest string in a render request
+#define DEPS_PAD 1e-6 //fraction of a cell boxes and rays are widened by, so rounding can't drop a cell
+#define WRITE_BLOCK 65536 //bytes of P3 text formatted before each fwrite()
+#define AA_THRESHOLD 24 //8 bit color difference between neighbouring pixels that counts as an edge
+#define AA_MAX_GRID 8 //largest --aa grid
+#define PROGRESSIVE_STEP 8 //grid of the first progressive pass, must divide TILE_SIZE
+#define TRACE_EVENTS 65536 //spans kept per thread when tracing, older ones are overwritten
+#define HEATMAP_OFF 0
+#define HEATMAP_TESTS 1 //heatmap of intersection tests per pixel, needs STATS
+#define HEATMAP_NS 2 //heatmap of nanoseconds per pixel
+#define SHADE_REFLECT 0 //a ShadeFrame's surface is yet to send out its reflected ray
+#define SHADE_REFRACT 1 //its refracted ray is next
+#define SHADE_LIGHTS 2 //both are done, only its lights are left
+//STRUCTURES
+// Plymorphism in C
+typedef struct Object{
+  int type; // 0 = sphere, 1 = plane
+  int json_index; //position of the object in the scene file's JSON array, counting the camera and lights
+  double position[3];
+  double diffuse_color[3];
+  double specular_color[3];
+  double reflectivity	;
+  double refractivity;
+  double ior;
+  double local_weight; //1-reflectivity-refractivity, the share of the color lit directly
+  union {
+    struct {
+      double radius;
+    } sphere;
+    struct {
+      double normal[3]; //unit length once prepare_scene() has run
+      double unit_normal[3]; //normal normalized again, as shading has always used it
+    } plane;
+  };
+} Object;
+
+typedef struct Camera{
+  double width;
+  double height;
+} Camera;
+
+typedef struct Light{
+  double color[3];
+  double position[3];
+  double direction[3];
+  double radial_a0;
+  double radial_a1;
+  double radial_a2;
+  double theta;
+  double angular_a0;
+  //set by prepare_scene()
+  double unit_direction[3];
+  double cos_theta; //cosine of the spotlight cone
+  int spotlight; //0 when theta or direction is zero, lighting every direction fully
+} Light;
+
+typedef struct Pixel{
+  unsigned char r, b, g;
+}Pixel;
+
+//color in floating point, not limited to 0..1 until it is written to the image
+typedef struct Color{
+  double r, g, b;
+} Color;
+
+typedef struct Closest{
+	Object* closest_object;
+	double closest_t;
+}Closest;
+
+//axis aligned box around a group of spheres. Interior nodes store their left child
+//at nodes[first] and their right child at nodes[first+1].
+typedef struct BVHNode{
+  double min[3];
+  double max[3];
+  int first; //leaf: first entry in BVH.indices, interior: index of the left child
+  int count; //number of spheres in a leaf, 0 for interior nodes
+} BVHNode;
+
+typedef struct BVH{
+  BVHNode *nodes;
+  int num_nodes;
+} BVH;
+
+//structure-of-arrays copy of the sphere geometry, in BVH leaf order, so a leaf is a
+//contiguous run that SIMD kernels can load a vector at a time
+typedef struct SphereArrays{
+  double *x, *y, *z; //center
+  double *r2; //radius squared
+  int *index; //index of the sphere in Scene.objects
+  int count;
+} SphereArrays;
+
+//structure-of-arrays copy of the planes, which are unbounded and tested outside the BVH
+typedef struct PlaneArrays{
+  double *px, *py, *pz; //position
+  double *nx, *ny, *nz; //unit normal
+  int *index; //index of the plane in Scene.objects
+  int count;
+} PlaneArrays;
+
+//block of rays sharing one origin, one ray per SIMD lane. Each array is indexed by
+//ray and padded so kernels can load a whole vector past the last ray.
+typedef struct RayPacket{
+  double origin[3];
+  double x[PACKET_RAYS + KERNEL_PAD], y[PACKET_RAYS + KERNEL_PAD], z[PACKET_RAYS + KERNEL_PAD]; //unit directions
+  double ro_rd_x[PACKET_RAYS + KERNEL_PAD], ro_rd_y[PACKET_RAYS + KERNEL_PAD], ro_rd_z[PACKET_RAYS + KERNEL_PAD]; //origin*direction, per axis
+  double a[PACKET_RAYS + KERNEL_PAD]; //direction dotted with itself
+  double inv_x[PACKET_RAYS], inv_y[PACKET_RAYS], inv_z[PACKET_RAYS]; //1/direction, for box tests
+  int count;
+} RayPacket;
+
+//intersection kernels test one ray against spheres/planes first..first+count-1 of the
+//arrays and write the distance to each into t, or -1 for a miss. Packet kernels test
+//every ray of a packet against one sphere/plane. Every version computes exactly what
+//sphere_intersection()/plane_intersection() would.
+typedef void (*SphereKernel)(SphereArrays *spheres, int first, int count, double *Ro, double *Rd, double *t);
+typedef void (*PlaneKernel)(PlaneArrays *planes, int first, int count, double *Ro, double *Rd, double *t);
+typedef void (*PacketSphereKernel)(SphereArrays *spheres, int sphere, RayPacket *packet, double *t);
+typedef void (*PacketPlaneKernel)(PlaneArrays *planes, int plane, RayPacket *packet, double *t);
+
+typedef struct Kernels{
+  const char *name;
+  SphereKernel spheres;
+  PlaneKernel planes;
+  PacketSphereKernel packet_spheres;
+  PacketPlaneKernel packet_planes;
+} Kernels;
+
+//a JSON file mapped into memory and the position reached in it
+typedef struct JsonReader{
+  const char *data; //not terminated, only size bytes are valid
+  size_t size;
+  size_t position;
+  char string[129]; //last string read by next_string()
+} JsonReader;
+
+//growable block of same-sized elements stored back to back. Growing may move the
+//block, so elements are referred to by index until the arena stops growing.
+typedef struct Arena{
+  char *data;
+  size_t element_size;
+  size_t count;
+  size_t capacity;
+} Arena;
+
+typedef struct Scene{
+  Camera camera;
+  Object *objects; //contiguous, in the order they appear in the JSON
+  int num_objects;
+  Light *lights; //contiguous, in the order they appear in the JSON
+  int num_lights;
+  BVH bvh;
+  SphereArrays spheres;
+  PlaneArrays planes;
+  void *mapping; //compiled scene file everything above points into, NULL if read from JSON
+  size_t mapping_size;
+} Scene;
+
+//start of a compiled scene file. Each section starts at the given byte offset,
+//64-byte aligned, and holds the same bytes as the matching array in memory.
+typedef struct SceneFileHeader{
+  char magic[8]; //SCENE_MAGIC
+  uint32_t version; //SCENE_VERSION
+  uint32_t object_size, light_size, node_size; //struct sizes the file was written with
+  uint64_t file_size;
+  uint64_t checksum; //scene_checksum() of everything after the header
+  Camera camera;
+  int32_t num_objects, num_lights, num_nodes, num_spheres, num_planes;
+  uint64_t objects, lights, nodes;
+  uint64_t sphere_x, sphere_y, sphere_z, sphere_r2, sphere_index;
+  uint64_t plane_px, plane_py, plane_pz, plane_nx, plane_ny, plane_nz, plane_index;
+} SceneFileHeader;
+
+//start of a G-buffer file, followed by one GBufferHit per pixel, top row first
+typedef struct GBufferHeader{
+  char magic[8]; //GBUFFER_MAGIC
+  uint32_t version; //GBUFFER_VERSION
+  int32_t width, height;
+  int32_t num_lights; //lights with a shadow bit, at most GBUFFER_LIGHTS
+  uint64_t geometry; //gbuffer_geometry() of the scene the hits were found in
+  uint64_t lights[GBUFFER_LIGHTS]; //gbuffer_light() of the light behind each shadow bit
+} GBufferHeader;
+
+//what the camera ray of one pixel hit, and which lights are blocked from that point
+typedef struct GBufferHit{
+  double t; //closest_t of the hit
+  int32_t object; //index in Scene.objects, -1 if nothing was hit
+  int32_t unused;
+  uint64_t shadowed; //bit j set if light j of the header is blocked
+} GBufferHit;
+
+//G-buffer of a render. Hits found by an earlier render of the same camera and
+//geometry are reused, and the hits of this render are written for the next one.
+typedef struct GBuffer{
+  GBufferHit *old; //per pixel, hits of an earlier render; NULL if there is none to reuse
+  int light_bits[GBUFFER_LIGHTS]; //per light of this render, its shadow bit in old, -1 if it moved or is new
+  GBufferHit *hits; //per pixel, filled in by this render
+  GBufferHeader *header; //of the file being written, hits follows it
+  void *old_mapping;
+  size_t old_size;
+  size_t size;
+  char *filename;
+  char *temp_name; //the new G-buffer is written here and renamed over filename once complete
+} GBuffer;
+
+//start of an incremental render's state file, followed by num_objects ObjectRecord,
+//the image (width*height Pixel, top row first) and DEPS_WORDS words per tile
+typedef struct IncrementalHeader{
+  char magic[8]; //INCREMENTAL_MAGIC
+  uint32_t version; //INCREMENTAL_VERSION
+  int32_t width, height;
+  int32_t aa;
+  int32_t num_objects;
+  int32_t unused;
+  uint64_t settings; //incremental_settings() of the render
+  double origin[3]; //lowest corner of the grid
+  double cell[3]; //size of a grid cell along each axis
+} IncrementalHeader;
+
+//what an incremental render remembers of an object, to tell whether it changed
+typedef struct ObjectRecord{
+  uint64_t key; //incremental_object(): checksum of everything about the object
+  double min[3], max[3]; //box around the object, infinite for planes
+} ObjectRecord;
+
+//state of an incremental render. Each tile keeps the grid cells its rays went
+//through; only tiles whose cells hold an object that changed are rendered again.
+typedef struct Incremental{
+  double origin[3]; //lowest corner of the grid
+  double cell[3]; //size of a grid cell along each axis
+  int tiles_x, tiles_y;
+  uint64_t *cells; //per tile, DEPS_WORDS words: the cells its rays crossed, and the DEPS_OUTSIDE bit
+  char *dirty; //per tile, 1 if its pixels are rendered again
+  char *dirty_centers; //per tile, 1 if its pixel centers are shaded again by the first antialiasing pass
+  int num_dirty; //tiles in dirty
+  ObjectRecord *objects; //per object of the scene being rendered
+  int num_objects;
+  uint64_t settings; //incremental_settings() of the render
+  int aa;
+  char *filename;
+} Incremental;
+
+//start of a partial image, one region of an image rendered on its own, followed by
+//its pixels, (x1-x0)*(y1-y0) Pixel, top row first
+typedef struct PartialHeader{
+  char magic[8]; //PARTIAL_MAGIC
+  uint32_t version; //PARTIAL_VERSION
+  int32_t width, height; //of the whole image
+  int32_t x0, y0; //first column and row of the region, rows counted from the top
+  int32_t x1, y1; //one past the last column and row
+  int32_t unused;
+  uint64_t settings; //partial_settings() of the render
+} PartialHeader;
+
+//counters kept by each render thread and summed at the end of a render. They are
+//only updated when STATS is defined; otherwise STAT_ADD() compiles to nothing.
+typedef struct Stats{
+  long primary_rays; //rays from the camera
+  long reflection_rays;
+  long refraction_rays;
+  long shadow_rays; //shadow rays traced
+  long shadow_rays_blocked; //shadow rays that found something between the point and the light
+  long shadow_cache_hits; //shadow rays answered by the last object to block the same light
+  long sphere_tests; //ray-sphere intersection tests
+  long plane_tests; //ray-plane intersection tests
+  long box_tests; //ray-box tests against BVH nodes
+  long depth[STATS_DEPTHS]; //surfaces shaded at each depth of recursion
+  long depth_limit_hits; //surfaces that would have reflected or refracted but were past the max depth
+  long weight_cutoffs; //reflection and refraction rays not traced because they would add too little
+  long roulette_survivals; //low weight rays traced anyway by Russian roulette
+  long aa_pixels; //pixels found on an edge and supersampled
+  long aa_samples; //rays shot for those pixels, on top of their centers
+  long gbuffer_hits; //camera rays not traced because the G-buffer had their hit
+  long gbuffer_shadows; //shadow rays not traced because the G-buffer had their answer
+} Stats;
+
+//what one object cost over a render, kept per thread when --object-stats is given
+typedef struct ObjectStats{
+  long hits; //times it was the surface shaded, from the camera or a bounce
+  long tests; //intersection tests against it
+  long rays; //reflection, refraction and shadow rays traced from its surface
+} ObjectStats;
+
+#ifdef STATS
+#define STAT_ADD(context, counter, amount) ((context)->stats.counter += (amount))
+#define STAT_OBJECT(context, object, counter, amount) \
+  ((context)->objects != NULL ? (void)((context)->objects[object].counter += (amount)) : (void)0)
+#define STAT_OBJECT_TESTS(context, index, count, amount) \
+  ((context)->objects != NULL ? object_tests((context)->objects, (index), (count), (amount)) : (void)0)
+#else
+#define STAT_ADD(context, counter, amount) ((void)0)
+#define STAT_OBJECT(context, object, counter, amount) ((void)0)
+#define STAT_OBJECT_TESTS(context, index, count, amount) ((void)0)
+#endif
+
+//a primitive that blocked a shadow ray: type 0 is slot in SphereArrays, type 1 is
+//slot in PlaneArrays, type -1 is none
+typedef struct Occluder{
+  int type;
+  int slot;
+} Occluder;
+
+//when recursive_shade() stops following reflections and refractions
+typedef struct Termination{
+  int max_depth; //deepest surface that reflected and refracted rays are traced from
+  double min_weight; //rays whose share of the pixel color would fall below this are not traced
+  int roulette; //1 to trace a random min_weight/weight of those rays anyway, scaled up to stay unbiased
+} Termination;
+
+//a surface being shaded by recursive_shade(), kept on the thread's stack of them
+//while the reflected and refracted rays leaving it are followed
+typedef struct ShadeFrame{
+  double Ro[3]; //origin of the ray that hit the surface
+  double Rd[3]; //direction of that ray
+  Closest hit;
+  int depth; //bounces from the camera, 0 for the camera ray's hit
+  int exiting_sphere; //1 if the ray is inside the sphere it hit
+  double weight; //share of the pixel color the ray makes up
+  double current_ior; //see recursive_shade()
+  double reflect_scale, refract_scale; //what ray_scale() gave the reflected and refracted rays, 0 if not traced
+  Color reflect, refract; //colors the reflected and refracted rays brought back
+  Color *result; //where the surface's color goes: reflect or refract of the frame below, or the answer
+  int stage; //SHADE_REFLECT, SHADE_REFRACT or SHADE_LIGHTS
+} ShadeFrame;
+
+//a reflected or refracted ray leaving a surface, worked out before it is traced
+typedef struct SecondaryRay{
+  double Ro[3];
+  double Rd[3];
+  double weight; //share of the pixel color it makes up
+  double ior_same; //IoR the surface it hits is seen through, if it is the surface it left
+  double ior_other; //the IoR for any other surface
+  int exiting_same; //1 if hitting the surface it left means leaving that sphere
+} SecondaryRay;
+
+//a wavefront render's reflected or refracted ray, waiting for the depth's rays to be intersected
+typedef struct WaveRay{
+  SecondaryRay ray;
+  int from; //the surface it leaves
+  int refracted; //1 for a refracted ray, 0 for a reflected one
+} WaveRay;
+
+//a wavefront render's shadow ray, from a surface to a light
+typedef struct ShadowRay{
+  double Ro[3]; //the point on the surface
+  double Rd[3]; //unit direction to the light
+  double distance; //to the light
+  int light;
+  int surface; //the surface it leaves
+  int blocked; //1 once traced, if something is in the way
+} ShadowRay;
+
+//a surface hit in a wavefront render. Surfaces are stored a depth after another,
+//so every surface comes after the one its ray left.
+typedef struct WaveSurface{
+  ShadeFrame frame; //the ray that hit it, and, once folded, the colors its own rays brought back
+  Color light; //direct_light() of the surface
+  int parent; //the surface the ray that hit this one left, -1 for a camera ray's hit
+  int refracted; //1 if that ray was refracted, 0 if it was reflected
+  int x, y; //for a camera ray's hit, its pixel
+  int first_shadow; //its shadow rays, one per light, start here
+} WaveSurface;
+
+//the queues a thread's wavefront render works through, kept between tiles
+typedef struct Wavefront{
+  WaveSurface *surfaces; //every surface hit in the tile
+  int num_surfaces, max_surfaces;
+  WaveRay *rays; //reflected and refracted rays of the depth being shaded
+  int num_rays, max_rays;
+  ShadowRay *shadows; //shadow rays of the depth being shaded
+  int num_shadows, max_shadows;
+} Wavefront;
+
+//state owned by one render thread, so it can be used without locking
+typedef struct ThreadContext{
+  Occluder *last_occluder; //per light, the last primitive that blocked it
+  Termination termination;
+  uint64_t random; //state of the Russian roulette random numbers, seeded per pixel
+  uint64_t shadow_known; //lights whose shadow at the camera ray's hit is already known from a G-buffer
+  uint64_t shadowed; //of those, the ones that are blocked
+  uint64_t shadow_found; //lights found blocked at the camera ray's hit, to store in the G-buffer
+  Incremental *incremental; //grid that rays are tracked through, NULL unless rendering incrementally
+  uint64_t *cells; //of the tile being rendered, the grid cells its rays crossed
+  ShadeFrame *frames; //recursive_shade()'s stack, one frame per depth up to the max depth
+  int num_frames;
+  Wavefront wavefront; //queues of wavefront_tile(), empty until it is used
+  Stats stats;
+  ObjectStats *objects; //per object in Scene.objects, NULL unless they are being counted
+} ThreadContext;
+
+typedef struct RenderOptions{
+  int threads; //number of worker threads used by generate_scene(), 1 = render on the calling thread
+  const char *simd; //intersection kernels to use: "scalar", "sse2", "avx2", or NULL for the best available
+  int packets; //1 to trace primary rays in PACKET_SIZE x PACKET_SIZE packets, 0 to trace them one at a time
+  int binary; //1 to write a binary P6 image, 0 for ASCII P3, -1 to decide from the file name
+  int stream_rows; //0 renders the whole image before writing it, otherwise the most rows held in memory
+  int aa; //edge pixels get up to aa x aa samples, 1 for one ray per pixel
+  int progressive; //1 to render coarse to fine, writing the image after each pass
+  int wavefront; //1 to shade each tile a depth at a time, stage by stage, instead of a pixel at a time
+  long time_budget; //milliseconds a progressive render may take, 0 for no limit
+  GBuffer *gbuffer; //primary hits to reuse and record, NULL for none
+  Incremental *incremental; //tiles to render again and their rays' cells, NULL for a full render
+  Termination termination;
+  int heatmap; //what cost[] measures per pixel: HEATMAP_OFF, HEATMAP_TESTS or HEATMAP_NS
+  long *cost; //per pixel of the image, top row first, when heatmap is on
+  Stats stats; //counters added up over every render thread
+  ObjectStats *objects; //per object, added up over every render thread; NULL to not count them
+} RenderOptions;
+
+typedef struct Tile{
+  int x0, y0; //first pixel of the tile
+  int x1, y1; //one past the last pixel of the tile
+} Tile;
+
+//double-ended queue of tiles owned by one worker. The owner pops from the bottom,
+//idle workers steal from the top.
+typedef struct TileQueue{
+  Tile *tiles;
+  int top;
+  int bottom;
+  pthread_mutex_t lock;
+} TileQueue;
+
+//everything a render worker needs to shade its tiles and steal from the others
+typedef struct RenderJob{
+  Scene *scene;
+  Pixel *buffer;
+  int width;
+  int height;
+  int x0, x1; //columns being rendered
+  int y0, y1; //rows being rendered; buffer holds just these rows and columns, top row first
+  int packets;
+  int wavefront; //1 to render tiles with wavefront_tile()
+  int heatmap;
+  long *cost; //laid out like buffer, NULL when heatmap is off
+  int aa; //largest supersampling grid, 1 when not antialiasing
+  int refine; //0 to shade pixel centers, 1 to supersample the edges among them
+  Pixel *centers; //the shaded centers of rows c0 to c1 and columns cx0 to cx1, top row first
+  int *hits; //index of the object each center hit, -1 for none; NULL unless antialiasing
+  int c0, c1; //rows held in centers and hits
+  int cx0, cx1; //columns held in centers and hits
+  int step; //progressive pass: trace pixels on this grid the coarser passes skipped; 0 when not progressive
+  int *tile_steps; //per tile, the finest grid it has been traced on
+  int tiles_x; //tiles across the image, to index tile_steps
+  long deadline; //CLOCK_MONOTONIC nanoseconds a progressive render stops refining at, 0 for none
+  GBuffer *gbuffer; //primary hits of the whole image to reuse and record, NULL for none
+  Incremental *incremental; //tiles of the whole image to render and record, NULL to render all
+  int num_queues;
+  TileQueue *queues;
+} RenderJob;
+
+typedef struct Worker{
+  RenderJob *job;
+  int id;
+  ThreadContext context __attribute__((aligned(64))); //on its own cache lines, the counters are written constantly
+  pthread_t thread;
+} Worker;
+
+//an image being rendered and written a band of rows at a time. The render side
+//fills one buffer while the writer thread encodes the other.
+typedef struct Stream{
+  FILE *file;
+  int binary;
+  int width;
+  int num_bands;
+  Pixel *bands[2];
+  int rows[2]; //rows waiting to be written from each buffer, 0 when it is free
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_t thread;
+} Stream;
+
+//rows of the image copied into a mapped P6 file by one thread
+typedef struct WriteJob{
+  Pixel *buffer;
+  unsigned char *data; //first pixel of the mapped file, just past the header
+  int width;
+  int first_row, last_row; //rows first_row up to, not including, last_row
+  pthread_t thread;
+} WriteJob;
+
+//one span of a --trace timeline
+typedef struct TraceEvent{
+  const char *name; //a string literal
+  long start, end; //nanoseconds since the trace started
+  int x, y; //first pixel of a tile, or -1
+} TraceEvent;
+
+//ring of the last TRACE_EVENTS spans of one thread. Only that thread writes to it,
+//so recording a span takes no lock.
+typedef struct TraceBuffer{
+  TraceEvent *events;
+  long count; //spans recorded; the ring holds the last TRACE_EVENTS of them
+} __attribute__((aligned(64))) TraceBuffer;
+
+//timeline of a render. Buffer 0 is the main thread, which is also render worker 0,
+//buffers 1 to threads-1 are the other workers and the last is the stream writer.
+typedef struct Trace{
+  TraceBuffer *buffers; //NULL when not tracing
+  int num_buffers;
+  long start; //CLOCK_MONOTONIC nanoseconds the trace is measured from
+} Trace;
+
+//a scene a render server keeps loaded, with what its file looked like when it was read
+typedef struct CachedScene{
+  char *path; //real path of the scene file, NULL for an empty slot
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  struct timespec mtime;
+  long loaded; //order the scenes were loaded in, the oldest is dropped first
+  Scene scene;
+} CachedScene;
+
+//state of a render server. The server fills in scenes; a child running a request
+//inherits them, and keeps where its reply goes in the rest.
+typedef struct Server{
+  CachedScene scenes[SCENE_CACHE];
+  long loads; //scenes loaded so far
+  int loaded; //write end of the pipe children report scenes they loaded on, -1 outside a server
+  int connection; //in a request's child, the client's socket, -1 otherwise
+  FILE *errors; //in a request's child, where stderr is kept until it is sent
+  char output[32]; //in a request's child, the file an image written to "-" goes to, empty if none
+  int status; //in a request's child, the exit status to send
+  volatile sig_atomic_t exited; //in the server, children reaped since serve() last counted them
+} Server;
+
+//PROTOTYPE DECLARATIONS 
+
+//--------------MAIN AND SERVER FUNCTIONS----------------------
+
+int render_command(int argc, char* argv[]);
+
+void serve(char* socket_path, int jobs);
+
+void server_child(int signal);
+
+void serve_request(int connection);
+
+void server_reply(void);
+
+char* server_output(void);
+
+void server_scene(char* filename, Scene* scene);
+
+void server_cache_update(int loaded);
+
+void server_cache_add(char* path, struct stat* info);
+
+int server_cache_copy(char* path, struct stat* info, char* copy);
+
+int server_cache_check(char* copy);
+
+int connect_server(char* socket_path, int argc, char* argv[]);
+
+int send_frame(int connection, char tag, const void* data, uint32_t size);
+
+int write_full(int file, const void* data, size_t size);
+
+int read_full(int file, void* data, size_t size);
+
+//--------------JSON READING FUNCTIONS----------------------
+
+int next_c(JsonReader* json);
+
+void expect_c(JsonReader* json, int d);
+
+void skip_ws(JsonReader* json);
+
+char* next_string(JsonReader* json);
+
+double next_number(JsonReader* json);
+
+void next_vector(JsonReader* json, double* v);
+
+void open_json(char* filename, JsonReader* json);
+
+void close_json(JsonReader* json);
+
+void read_scene(char* filename, Scene* scene);
+
+void prepare_scene(Scene* scene);
+
+void free_scene(Scene* scene);
+
+//--------------ARENA FUNCTIONS----------------------
+
+void arena_init(Arena* arena, size_t element_size);
+
+void* arena_push(Arena* arena);
+
+void* arena_release(Arena* arena);
+
+//--------------SCENE FILE FUNCTIONS----------------------
+
+void load_scene(char* filename, Scene* scene);
+
+void compile_scene(char* input, char* output);
+
+size_t scene_section(size_t* offset, size_t size);
+
+void write_compiled_scene(Scene* scene, char* filename);
+
+void load_compiled_scene(char* filename, Scene* scene);
+
+int scene_section_fits(uint64_t offset, size_t size, size_t file_size);
+
+uint64_t scene_checksum(const unsigned char* data, size_t size);
+
+//--------------GBUFFER FUNCTIONS----------------------
+
+void gbuffer_open(GBuffer* gbuffer, char* filename, Scene* scene, int width, int height);
+
+void gbuffer_close(GBuffer* gbuffer, int complete);
+
+uint64_t gbuffer_geometry(Scene* scene, int width, int height);
+
+uint64_t gbuffer_light(Light* light);
+
+void gbuffer_hit(RenderJob* job, int x, int y, double* Rd, Closest* hit);
+
+//--------------INCREMENTAL FUNCTIONS----------------------
+
+int incremental_open(Incremental* incremental, char* filename, Scene* scene, int width, int height, RenderOptions* options, Pixel* buffer);
+
+void incremental_close(Incremental* incremental, Pixel* buffer, int width, int height);
+
+uint64_t incremental_settings(Scene* scene, RenderOptions* options, int width, int height);
+
+void incremental_object(Object* object, ObjectRecord* record);
+
+void incremental_grid(Incremental* incremental, Scene* scene);
+
+void incremental_mark(Incremental* incremental, ObjectRecord* record);
+
+void incremental_dilate(Incremental* incremental, char* from, char* to);
+
+void deps_segment(ThreadContext* context, double* Ro, double* Rd, double t);
+
+int deps_cell(double cell);
+
+//--------------PARTIAL IMAGE FUNCTIONS----------------------
+
+uint64_t partial_settings(Scene* scene, RenderOptions* options, int width, int height);
+
+void write_partial(Pixel* buffer, char* filename, uint64_t settings, int width, int height, int* region);
+
+void read_partial(FILE* file, PartialHeader* header, char* filename);
+
+void merge_partials(char* filename, int format, int count, char** partials);
+
+//--------------VECTOR FUNCTIONS----------------------
+void vector_normalize(double* v);
+
+double vector_dot_product(double *v1, double *v2);
+
+void vector_cross_product(double *v1, double *v2, double *result);
+
+double vector_length(double *vector);
+
+void vector_reflection(double *N, double *L, double *result);
+
+void vector_subtraction(double *v1, double *v2, double *result);
+
+void vector_addition(double *v1, double *v2, double *result);
+
+void vector_scale(double *vector, double scalar, double *result);
+
+//--------------INTERSECTION FUNCTIONS----------------------
+
+double sphere_intersection(double* Ro, double* Rd, double* C, double r);
+
+double plane_intersection(double* Ro, double* Rd, double* P, double* N);
+
+Closest shoot(double* Ro, double* Rd, Scene* scene, ThreadContext* context);
+
+int shoot_shadow(double* Ro, double* Rd, double max_t, Object* ignore, Scene* scene, Occluder* blocker, ThreadContext* context);
+
+int light_blocked(Scene* scene, ThreadContext* context, int light, double* Ro, double* Rd, double max_t, Object* ignore);
+
+void object_tests(ObjectStats* objects, int* index, int count, long amount);
+
+int sphere_blocks(SphereArrays* spheres, int slot, double* Ro, double* Rd, double max_t);
+
+int plane_blocks(PlaneArrays* planes, int slot, double* Ro, double* Rd, double max_t);
+
+void closest_hit(double* t, int* index, int count, double* best_t, int* best_index);
+
+int any_hit(double* t, int* index, int count, double max_t, int ignore);
+
+void make_packet(RayPacket* packet, double* Ro, double (*Rd)[3], int count);
+
+void shoot_packet(RayPacket* packet, Scene* scene, ThreadContext* context, Closest* results);
+
+int packet_box(BVHNode* node, RayPacket* packet, double* best_t, int first_ray, double* near_t, ThreadContext* context);
+
+int ray_box(BVHNode* node, double* Ro, double* inv_Rd, double max_t, double* near_t);
+
+//--------------BVH FUNCTIONS----------------------
+
+void build_bvh(Scene* scene);
+
+void build_bvh_node(BVH* bvh, int* indices, int node_index, int first, int count, double* bounds, double* centroids, int depth);
+
+double box_area(double* min, double* max);
+
+void free_bvh(BVH* bvh);
+
+void build_arrays(Scene* scene, int* sphere_indices, int num_spheres, int* plane_indices, int num_planes);
+
+void free_arrays(Scene* scene);
+
+//--------------SIMD KERNEL FUNCTIONS----------------------
+
+int kernels_supported(const char* name);
+
+void select_kernels(const char* name);
+
+void spheres_scalar(SphereArrays* spheres, int first, int count, double* Ro, double* Rd, double* t);
+
+void planes_scalar(PlaneArrays* planes, int first, int count, double* Ro, double* Rd, double* t);
+
+void packet_spheres_scalar(SphereArrays* spheres, int sphere, RayPacket* packet, double* t);
+
+void packet_planes_scalar(PlaneArrays* planes, int plane, RayPacket* packet, double* t);
+
+#if defined(__x86_64__) || defined(__i386__)
+void spheres_sse2(SphereArrays* spheres, int first, int count, double* Ro, double* Rd, double* t);
+
+void planes_sse2(PlaneArrays* planes, int first, int count, double* Ro, double* Rd, double* t);
+
+void spheres_avx2(SphereArrays* spheres, int first, int count, double* Ro, double* Rd, double* t);
+
+void planes_avx2(PlaneArrays* planes, int first, int count, double* Ro, double* Rd, double* t);
+
+void packet_spheres_sse2(SphereArrays* spheres, int sphere, RayPacket* packet, double* t);
+
+void packet_planes_sse2(PlaneArrays* planes, int plane, RayPacket* packet, double* t);
+
+void packet_spheres_avx2(SphereArrays* spheres, int sphere, RayPacket* packet, double* t);
+
+void packet_planes_avx2(PlaneArrays* planes, int plane, RayPacket* packet, double* t);
+#endif
+//--------------LIGHT FUNCTIONS----------------------
+
+double calculate_diffuse(double object_diff_color, double light_color, double *N, double *L);
+
+double calculate_specular(double *L, double *N, double *R, double *V, double object_spec_color, double light_color);
+
+double frad(Light * light, double t);
+
+double fang(Light *light, double *L);
+
+//--------------IMAGE FUNCTIONS----------------------
+
+void default_options(RenderOptions* options);
+
+void generate_scene(Scene* scene, Pixel* buffer, int width, int height, RenderOptions* options);
+
+void generate_band(Scene* scene, Pixel* buffer, int width, int height, int y0, int y1, RenderOptions* options);
+
+void generate_region(Scene* scene, Pixel* buffer, int width, int height, int x0, int y0, int x1, int y1, RenderOptions* options);
+
+void render_job(RenderJob* job, RenderOptions* options);
+
+void stream_scene(Scene* scene, char* filename, int width, int height, RenderOptions* options);
+
+void* stream_writer(void* arg);
+
+int progressive_scene(Scene* scene, Pixel* buffer, char* filename, int width, int height, RenderOptions* options);
+
+void progressive_tile(RenderJob* job, ThreadContext* context, Tile* tile);
+
+void trace_pixels(RenderJob* job, ThreadContext* context, double (*Rd)[3], int (*pixels)[2], int count);
+
+int progressive_stop(RenderJob* job);
+
+void progressive_interrupt(int signal);
+
+void fill_preview(Pixel* buffer, int* tile_steps, int tiles_x, int width, int height);
+
+void render_tile(RenderJob* job, ThreadContext* context, Tile* tile);
+
+void refine_tile(RenderJob* job, ThreadContext* context, Tile* tile);
+
+int pixel_on_edge(RenderJob* job, int x, int y);
+
+Pixel supersample_pixel(RenderJob* job, ThreadContext* context, int x, int y);
+
+long pixel_cost(RenderJob* job, ThreadContext* context);
+
+void primary_ray(Camera* camera, int width, int height, int x, int y, double sx, double sy, double* Rd);
+
+void shade_pixel(RenderJob* job, ThreadContext* context, int x, int y, double* Ro, double* Rd, Closest* nearest_object);
+
+void store_pixel(RenderJob* job, int x, int y, Closest* nearest_object, Color color);
+
+void wavefront_tile(RenderJob* job, ThreadContext* context, Tile* tile);
+
+void wavefront_depth(RenderJob* job, ThreadContext* context, int first, int last);
+
+void wavefront_reserve(void** array, int* capacity, int needed, size_t size);
+
+int pop_tile(TileQueue* queue, Tile* tile);
+
+int steal_tile(TileQueue* queue, Tile* tile);
+
+void* render_worker(void* arg);
+
+void context_init(ThreadContext* context, Scene* scene, int count_objects);
+
+void context_free(ThreadContext* context);
+
+void stats_add(Stats* total, Stats* stats);
+
+void write_stats(Stats* stats, Termination* termination, char* filename);
+
+void write_object_stats(Scene* scene, ObjectStats* objects, char* filename);
+
+void write_heatmap(long* cost, char* filename, int width, int height, int binary, int threads);
+
+Color recursive_shade(Scene* scene, ThreadContext* context, double* Ro, double* Rd, Closest* current_object, int depth, double weight, double current_ior, int exiting_sphere);
+
+void shade_frame(ShadeFrame* frame, double* Ro, double* Rd, Closest* hit, int depth, double weight, double current_ior, int exiting_sphere, Color* result);
+
+#ifdef STATS
+void frame_stats(Scene* scene, ThreadContext* context, ShadeFrame* frame);
+#endif
+
+int reflect_ray(Scene* scene, ThreadContext* context, ShadeFrame* frame, SecondaryRay* ray);
+
+int refract_ray(Scene* scene, ThreadContext* context, ShadeFrame* frame, SecondaryRay* ray);
+
+int follow_ray(Scene* scene, ThreadContext* context, SecondaryRay* ray, ShadeFrame* frame, ShadeFrame* child, Color* result);
+
+void secondary_frame(ShadeFrame* child, SecondaryRay* ray, ShadeFrame* frame, Closest* hit, Color* result);
+
+Color direct_light(Scene* scene, ThreadContext* context, ShadeFrame* frame);
+
+void surface_point(ShadeFrame* frame, double* Ron, double* N, double* V);
+
+double shadow_ray(Light* light, double* Ron, double* Rdn);
+
+void light_surface(Object* object, Light* light, double* N, double* V, double* Rdn, double distance_to_light, double* color);
+
+Color surface_color(ShadeFrame* frame, Color light);
+
+void surface_normal(Object* object, double* point, double* N);
+
+double ray_scale(ThreadContext* context, double weight);
+
+void seed_random(ThreadContext* context, int x, int y, int sample);
+
+double next_random(ThreadContext* context);
+
+void write_image(Pixel *buffer, char *filename, int width, int height, int binary, int threads);
+
+int image_binary(char *filename, int format);
+
+void write_p3(Pixel *buffer, FILE *output_file, int width, int height, int max_color);
+
+void write_p3_pixels(Pixel *buffer, size_t count, FILE *output_file, int *current_width);
+
+void write_p6_pixels(Pixel *buffer, size_t count, FILE *output_file);
+
+void write_p6(Pixel *buffer, char *filename, int width, int height, int max_color, int threads);
+
+void* write_p6_rows(void *arg);
+
+double clamp(double value);
+
+//--------------TRACE FUNCTIONS----------------------
+
+void trace_init(int num_buffers);
+
+long trace_now(void);
+
+void trace_span(int buffer, const char* name, long start, int x, int y);
+
+void write_trace(char* filename);
+
+void trace_free(void);
+
+//Global variable for tracking during reading of JSON file, to report errors.
+extern int line;
+
+//Intersection kernels in use, picked by select_kernels() for the running CPU.
+extern Kernels kernels;
+
+//Set when a progressive render is interrupted with SIGINT.
+extern volatile sig_atomic_t interrupted;
+
+//Timeline recorded for --trace, empty unless trace_init() has been called.
+extern Trace trace;
+
+//Scenes kept loaded by --serve, and where a request's reply goes.
+extern Server server;
+
+#endif